@@ -31,6 +31,13 @@ typedef struct{
   char* max_incomplete;
   void* iterate_roots;
   void* iterate_references_in_stack_frames;
+  void* large_objects;
+  uint64_t large_objects_size;
+  uint64_t large_objects_size_after_gc;
+  char* nursery_limit;
+  uint64_t allocation_buffer_size;
+  void* free_stack_classes;
+  uint64_t cached_stack_bytes;
 } Heap;
 
 //The first fields in VMState are used by the core library
@@ -10,6 +10,9 @@
   #include<sys/wait.h>
   #include<sys/mman.h>
 #endif
+#ifdef PLATFORM_LINUX
+  #include<sys/syscall.h>
+#endif
 #include<stdint.h>
 #include<stdbool.h>
 #include<unistd.h>
@@ -105,6 +108,7 @@ typedef struct{
   stz_byte* marking_stack_start;
   stz_byte* marking_stack_bottom;
   stz_byte* marking_stack_top;
+  stz_byte* heap_nursery_limit;
 } VMInit;
 
 //     Macro Readers
@@ -498,6 +502,48 @@ static void protect(void* p, stz_long size, stz_int prot) {
   if (size && mprotect(p, (size_t)size, prot)) exit_with_error();
 }
 
+//Give the kernel placement hints for a freshly reserved segment.
+//- STANZA_HUGE_PAGES=1: Back the segment with transparent huge pages.
+//- STANZA_NUMA_LOCAL=1: Prefer the NUMA node of the calling CPU.
+//Both are hints only, so failures are ignored.
+#if defined(PLATFORM_LINUX)
+
+//Returns true if the given environment variable is set to a value other than "0".
+static bool env_flag (const char* name) {
+  const char* value = getenv(name);
+  return value != NULL && value[0] != 0 && strcmp(value, "0") != 0;
+}
+
+static void advise_memory (void* p, stz_long size) {
+  static int initialized = 0;
+  static bool huge_pages = false;
+  static bool numa_local = false;
+  if (!initialized) {
+    huge_pages = env_flag("STANZA_HUGE_PAGES");
+    numa_local = env_flag("STANZA_NUMA_LOCAL");
+    initialized = 1;
+  }
+
+  #ifdef MADV_HUGEPAGE
+    if (huge_pages) madvise(p, (size_t)size, MADV_HUGEPAGE);
+  #endif
+
+  if (numa_local) {
+    unsigned int cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0 && node < 64) {
+      //MPOL_PREFERRED = 1. Spelled out to avoid depending on libnuma headers.
+      unsigned long nodemask = 1UL << node;
+      syscall(SYS_mbind, p, (unsigned long)size, 1, &nodemask, 64UL, 0U);
+    }
+  }
+}
+
+#else
+
+static void advise_memory (void* p, stz_long size) {}
+
+#endif
+
 //Allocates a segment of memory that is min_size allocated, and can be
 //resized up to max_size.
 //This function is called from within Stanza, and min_size and max_size
@@ -505,6 +551,7 @@ static void protect(void* p, stz_long size, stz_int prot) {
 void* stz_memory_map (stz_long min_size, stz_long max_size) {
   void* p = mmap(NULL, (size_t)max_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
   if (p == MAP_FAILED) exit_with_error();
+  advise_memory(p, max_size);
 
   protect(p, min_size, PROT_READ | PROT_WRITE | PROT_EXEC);
   return p;
@@ -530,11 +577,37 @@ void stz_memory_resize (void* p, stz_long old_size, stz_long new_size) {
     min_size = new_size;
     max_size = old_size;
     prot = PROT_NONE;
+    //Revoking access alone keeps the pages resident, so
+    //explicitly return them to the OS.
+    if (madvise((char*)p + min_size, (size_t)(max_size - min_size), MADV_DONTNEED))
+      exit_with_error();
   }
 
   protect((char*)p + min_size, max_size - min_size, prot);
 }
 
+//Maps the given file into memory for reading, and stores its
+//size in *size. Returns NULL if the file could not be mapped.
+void* stz_map_file (const char* filename, stz_long* size) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return NULL;
+  struct stat st;
+  void* p = NULL;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) p = NULL;
+    else *size = (stz_long)st.st_size;
+  }
+  close(fd);
+  return p;
+}
+
+//Unmaps a file mapped with stz_map_file. Always returns 0.
+int stz_unmap_file (void* p, stz_long size) {
+  if (p) munmap(p, (size_t)size);
+  return 0;
+}
+
 #endif
 
 //============================================================
@@ -590,6 +663,32 @@ void stz_memory_resize (void* p, stz_long old_size, stz_long new_size) {
   }
 }
 
+//Maps the given file into memory for reading, and stores its
+//size in *size. Returns NULL if the file could not be mapped.
+void* stz_map_file (const char* filename, stz_long* size) {
+  HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE) return NULL;
+  void* p = NULL;
+  LARGE_INTEGER file_size;
+  if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0) {
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping != NULL) {
+      p = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+      if (p != NULL) *size = (stz_long)file_size.QuadPart;
+      CloseHandle(mapping);
+    }
+  }
+  CloseHandle(file);
+  return p;
+}
+
+//Unmaps a file mapped with stz_map_file. Always returns 0.
+int stz_unmap_file (void* p, stz_long size) {
+  if (p) UnmapViewOfFile(p);
+  return 0;
+}
+
 #endif
 
 //============================================================
@@ -599,107 +698,115 @@ void stz_memory_resize (void* p, stz_long old_size, stz_long new_size) {
 #if defined(PLATFORM_OS_X) || defined(PLATFORM_LINUX)
 
 #include <sys/time.h>
-#include <pthread.h>
-
-static pthread_t main_thread_handle;
-
-static pthread_t thread_create(int thread_routine(void *parameter), void *parameter) {
-  pthread_attr_t attr;
-  pthread_t os_thread;
-
-  if (pthread_attr_init(&attr) != 0) {
-    return 0;
-  }
-
-  // Don't leave thread/stack around after exit for join:
-  if (pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0) {
-    return 0;
-  }
-
-  // Apparently, it is a different type on Linux.
-  void* (*routine)(void*) = (void*(*)(void *))thread_routine;
 
-  if (pthread_create(&os_thread, &attr, routine, NULL) != 0) {
-    return 0;
-  }
-  return os_thread;
-}
-
-static bool ticker_stopped = false;
-static bool ticker_running = false;
-static bool ticker_stopping = false;
-static bool ticker_created = false;
-static bool EnableTicks = true;
-static int TickInterval = 100; // mSec
+//Samples are triggered by SIGPROF, delivered by an ITIMER_PROF interval
+//timer every 'msecs' of consumed CPU time. The handler is async-signal-safe:
+//it only records the interrupted program counter and raises the profile flag.
+//The stack itself is recorded by profile-stack-trace in core at the next
+//safepoint, which is where Stanza frames are guaranteed to be consistent.
+//The interrupted program counter lets the profiler attribute the sample to
+//the code that was actually running instead of to the safepoint.
 
 static uint64_t *profile_flag;
 static uint64_t *function_counters;
 static int num_functions;
 
-// Timer thread that sets flag every tickinterval msecs
-static int ticker_thread_routine(void *parameter) {
-  ticker_stopped = false;
-  while (!ticker_stopping) {
-    usleep(TickInterval * 1000);
-
-    if (ticker_running) {
-      if (*profile_flag != 2L) // Not still profiling stack trace?
-        *profile_flag = 1L;    // Profile next stack trace
-    }
-  }
-  ticker_stopped = true;
-  return 0;
+//The program counter interrupted by the most recent sample, or 0 if it has
+//already been consumed by take_profile_sample_pc.
+static volatile sig_atomic_t sample_pending = 0;
+static volatile uint64_t sample_pc = 0;
+
+//Retrieve the interrupted program counter from a signal context.
+//Returns 0 on platforms where it is not known how to retrieve it.
+static uint64_t interrupted_pc (void* input_context) {
+  ucontext_t* context = (ucontext_t*)input_context;
+  #if defined(PLATFORM_LINUX) && defined(__x86_64__)
+    //Index 16 is REG_RIP, which is only named when _GNU_SOURCE is defined.
+    return (uint64_t)context->uc_mcontext.gregs[16];
+  #elif defined(PLATFORM_LINUX) && defined(__aarch64__)
+    return (uint64_t)context->uc_mcontext.pc;
+  #elif defined(PLATFORM_OS_X) && defined(__x86_64__)
+    return (uint64_t)context->uc_mcontext->__ss.__rip;
+  #elif defined(PLATFORM_OS_X) && defined(__arm64__)
+    return (uint64_t)context->uc_mcontext->__ss.__pc;
+  #else
+    return 0;
+  #endif
 }
 
-bool start_ticks() {
-  if (!EnableTicks) {
-    return true;
-  }
-  ticker_running = true;
-  ticker_stopping = false;
-  if (!ticker_created) {
-    ticker_created = true;
-    if (thread_create(ticker_thread_routine, 0) == 0) {
-      return false;
-    }
-  }
-  return true;
+static void sigprof_handler (int sig, siginfo_t* info, void* context) {
+  (void)sig;
+  (void)info;
+  //Do not disturb a stack trace that is currently being recorded.
+  if (*profile_flag == 2L) return;
+  sample_pc = interrupted_pc(context);
+  sample_pending = 1;
+  *profile_flag = 1L;
 }
 
-static void suspend_ticks() {
-  ticker_running = false;
-  sleep(1); // why is this necessary?
+//Return the program counter interrupted by the latest sample, or 0 if
+//there is none. Called from profile-stack-trace in core.
+uint64_t take_profile_sample_pc () {
+  if (!sample_pending) return 0;
+  sample_pending = 0;
+  return sample_pc;
 }
 
-static void resume_ticks() {
-  start_ticks();
+//The SIGPROF action that was installed before profiling started.
+static struct sigaction old_sigprof_action;
+
+//Stanza stacks grow upwards, so the memory below the stack pointer
+//holds live frames. The handler must therefore run on a separate
+//signal stack. Installs one unless the thread already has one.
+static int ensure_signal_stack () {
+  static char* sigprof_stack = NULL;
+  stack_t current;
+  if (sigaltstack(NULL, &current) != 0) return 0;
+  if (!(current.ss_flags & SS_DISABLE)) return 1;
+  if (sigprof_stack == NULL)
+    sigprof_stack = (char*)stz_malloc(SIGSTKSZ);
+  stack_t ss;
+  ss.ss_sp = (void*)sigprof_stack;
+  ss.ss_size = SIGSTKSZ;
+  ss.ss_flags = 0;
+  return sigaltstack(&ss, NULL) == 0;
 }
 
-static void stop_ticks() {
-  if (ticker_created) {
-    ticker_stopping = true;
-    if (ticker_running) {
-      for (int i=0; i<10 && !ticker_stopped; i++) { // Wait for thread to die 
-        usleep(TickInterval * 1000);
-      }
-    }
-    ticker_created = false;
-    ticker_running = false;
-    ticker_stopped = false;
-  }
+//Arm the profiling timer with the given interval. An interval of 0 disarms it.
+static int set_profile_timer (int msecs) {
+  struct itimerval timer;
+  timer.it_interval.tv_sec = msecs / 1000;
+  timer.it_interval.tv_usec = (msecs % 1000) * 1000;
+  timer.it_value = timer.it_interval;
+  return setitimer(ITIMER_PROF, &timer, NULL) == 0;
 }
 
 int start_sample_profiling (int msecs, int num_functions_arg, uint64_t *profile_flag_arg, uint64_t *function_counters_arg) {
-  TickInterval = msecs;
   num_functions = num_functions_arg;
   profile_flag = profile_flag_arg;
   function_counters = function_counters_arg;
-  start_ticks();
-  return 1;
+  sample_pending = 0;
+
+  //Install the SIGPROF handler. SA_RESTART so that sampling does not
+  //interrupt blocking system calls in the program, and SA_ONSTACK so
+  //that the signal frame does not overwrite Stanza frames.
+  if (!ensure_signal_stack()) return 0;
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = sigprof_handler;
+  action.sa_flags = SA_SIGINFO | SA_RESTART | SA_ONSTACK;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, &old_sigprof_action) != 0) return 0;
+
+  return set_profile_timer(msecs <= 0 ? 1 : msecs);
 }
 
 int stop_sample_profiling() {
-  stop_ticks();
+  //Disarm the timer first, so that no signal arrives after the
+  //handler is reset.
+  set_profile_timer(0);
+  sigaction(SIGPROF, &old_sigprof_action, NULL);
+  sample_pending = 0;
   return 1;
 }
 
@@ -711,6 +818,124 @@ int start_sample_profiling (int msecs, int num_functions_arg, uint64_t *profile_
 int stop_sample_profiling () {
   return 0;
 }
+uint64_t take_profile_sample_pc () {
+  return 0;
+}
+
+#endif
+
+//============================================================
+//================== Event Counters ==========================
+//============================================================
+
+//The counter arena allocated by core. Slot i holds values[i], and is
+//written out as labels[i], or skipped if labels[i] is NULL.
+static const char* counters_filename;
+static stz_long* counters_length;
+static char** counters_labels;
+static stz_long* counters_values;
+
+//Writes the non-zero counters to counters_filename.
+static void dump_counters (void) {
+  FILE* f = fopen(counters_filename, "w");
+  if (f == NULL) return;
+  for (stz_long i = 0; i < *counters_length; i++) {
+    if (counters_labels[i] != NULL && counters_values[i] != 0)
+      fprintf(f, "%s %lld\n", counters_labels[i], (long long)counters_values[i]);
+  }
+  fclose(f);
+}
+
+//Dumps the counter arena to the given file when the program exits.
+//The arena is read at exit, so counters registered afterwards are included.
+//Returns 0 if the dump could not be registered.
+int stz_dump_counters_at_exit (const char* filename, stz_long* length, char** labels, stz_long* values) {
+  counters_filename = filename;
+  counters_length = length;
+  counters_labels = labels;
+  counters_values = values;
+  return atexit(dump_counters) == 0;
+}
+
+//============================================================
+//============ Hardware Performance Counters =================
+//============================================================
+
+//The counters are read in this order: cycles, instructions,
+//cache misses, branch misses.
+#define NUM_PERF_COUNTERS 4
+
+#ifdef PLATFORM_LINUX
+
+#include <linux/perf_event.h>
+
+//A counter group is an array of NUM_PERF_COUNTERS file descriptors.
+//The first is the group leader. Each timing log opens its own group.
+
+//Stops counting and frees the group. Always returns 0.
+int stz_perf_counters_close (int* fds) {
+  for (int i = 0; i < NUM_PERF_COUNTERS; i++)
+    if (fds[i] >= 0) close(fds[i]);
+  stz_free(fds);
+  return 0;
+}
+
+//Starts counting user-space events of the calling thread, and returns
+//the new counter group. Returns NULL if the counters are not available,
+//e.g. if perf_event_paranoid forbids it.
+int* stz_perf_counters_open (void) {
+  static const uint64_t configs[NUM_PERF_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES
+  };
+  int* fds = (int*)stz_malloc(NUM_PERF_COUNTERS * sizeof(int));
+  for (int i = 0; i < NUM_PERF_COUNTERS; i++)
+    fds[i] = -1;
+  for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = configs[i];
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, fds[0], 0);
+    if (fds[i] < 0) {
+      stz_perf_counters_close(fds);
+      return NULL;
+    }
+  }
+  return fds;
+}
+
+//Stores the current value of each counter of the group in values.
+//Stores zeroes and returns 0 if the counters could not be read.
+int stz_perf_counters_read (int* fds, stz_long* values) {
+  uint64_t buffer[1 + NUM_PERF_COUNTERS];
+  bool ok = read(fds[0], buffer, sizeof(buffer)) == (ssize_t)sizeof(buffer);
+  for (int i = 0; i < NUM_PERF_COUNTERS; i++)
+    values[i] = ok ? (stz_long)buffer[1 + i] : 0;
+  return ok;
+}
+
+#else
+
+int* stz_perf_counters_open (void) {
+  return NULL;
+}
+int stz_perf_counters_close (int* fds) {
+  (void)fds;
+  return 0;
+}
+int stz_perf_counters_read (int* fds, stz_long* values) {
+  (void)fds;
+  for (int i = 0; i < NUM_PERF_COUNTERS; i++)
+    values[i] = 0;
+  return 0;
+}
 
 #endif
 
@@ -821,6 +1046,7 @@ STANZA_API_FUNC int MAIN_FUNC (int argc, char* argv[]) {
   init.heap_old_objects_end = init.heap_start;
   init.heap_top = init.heap_old_objects_end + nursery_size;
   init.heap_limit = init.heap_top + nursery_size;
+  init.heap_nursery_limit = init.heap_limit;
 
   //Allocate bitset for heap
   const stz_long min_bitset_size = bitset_size(min_heap_size);
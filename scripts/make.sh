@@ -69,6 +69,8 @@ PKGFILES="math \
           stz/arg-parser \
           stz/macro-plugin \
           stz/timing-log-reader \
+          stz/heap-snapshot-reader \
+          stz/coverage-report \
           stz/dependency-analyzer"
 PKGDIR="${PLATFORM_PREFIX}pkgs"
 STANZA_S="${PLATFORM_PREFIX}stanza.s"